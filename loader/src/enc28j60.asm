@@ -142,40 +142,6 @@ do_end_transaction:
     jp   enc28j60_end_transaction_and_return
 
 
-;; ----------------------------------------------------------------------------
-;; Macro for spi_read_byte_to_memory below. Reads one bit from SPI to
-;; register E. Requires registers to be loaded as follows:
-;;
-;;   B == SPI_IDLE+SPI_MOSI
-;;   C == SPI_OUT
-;;   D == SPI_IDLE+SPI_SCK
-;;
-;; NOTE: the reason for including the bit SPI_MOSI in B is to ensure BC points
-;; to a non-contended address (0xc09f). See "Contended Input/Output" in
-;; https://worldofspectrum.org/faq/reference/48kreference.htm#Contention:
-;;
-;;  "The address of the port being accessed is placed on the data bus. If this
-;;   is in the range 0x4000 to 0x7fff, the ULA treats this as an attempted
-;;   access to contended memory and therefore introduces a delay. If the port
-;;   being accessed is between 0xc000 and 0xffff, this effect does not apply,
-;;   even on a 128K machine if a contended memory bank is paged into the range
-;;   0xc000 to 0xffff."
-;;
-;; The MOSI bit will be ignored by the ENC28J60 during a read operation
-;; (ENC28J60 writes, Spectrum reads). See section 4, figure 4.2 in the ENC28J60
-;; data sheet ("Don't Care").
-;; ----------------------------------------------------------------------------
-
-   .macro READ_BIT_TO_E
-
-    out   (c), b         ;; 12
-    out   (c), d         ;; 12
-    in    a, (SPI_IN)    ;; 11
-    rra                  ;;  4
-    rl    e              ;;  8,   total 47
-
-   .endm
-
 ;; ----------------------------------------------------------------------------
 ;; Subroutine: read one byte. Call with secondary bank selected.
 ;;
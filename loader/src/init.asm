@@ -363,9 +363,6 @@ initialize_global_data:
   ld    (hl), #BLACK + (WHITE << 3)
   ldir
 
-  ld    a, #WHITE
-  out   (ULA_PORT), a
-
   ld    (hl), c
   ld    bc, #_font_data - _stack_top + 1  ;; plus one, due to using 0x3f above
   ldir
@@ -401,11 +398,19 @@ stage2_start:
 
   ;; --------------------------------------------------------------------------
   ;; If the version mark above checks out, execution continues here
+  ;; (with a jump to run_menu, menu.asm)
   ;; --------------------------------------------------------------------------
 
-  .area _NONRESIDENT          ;; continues here
+  .area _RESIDENT             ;; kept in RAM while loading (0x6300..0x63ff)
+  .area _NONRESIDENT          ;; overwritten by the loaded snapshot
   .area _SNAPSHOTLIST         ;; area for loaded snapshot list
 
+nbr_pages:
+  .ds    1
+
+snapshot_jump_table:
+  .ds    2 * JUMP_TABLE_ENTRIES
+
 nbr_snapshots:
   .ds    1
 
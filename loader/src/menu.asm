@@ -33,6 +33,7 @@
     .module menu
 
     .include "menu.inc"
+    .include "resident.inc"
 
     .include "context_switch.inc"
     .include "enc28j60.inc"
@@ -92,6 +93,129 @@ get_filename_pointer:
     pop   bc
     ret
 
+;; ############################################################################
+;; expand_snapshot_list
+;;
+;; menu.bin holds the snapshot file names prefix-compressed (see
+;; utils/speccyboot-update). After nbr_snapshots, each name is stored as the
+;; number of leading characters shared with the previous name, followed by
+;; the remaining characters up to the ".z80" extension, and a NUL.
+;;
+;; The compressed list is first moved to the top of RAM, and then expanded
+;; to snapshot_array (pointers), followed by the full file names. Fails with
+;; FATAL_FILE_TOO_LARGE if the expanded names would overwrite compressed ones
+;; not yet read.
+;;
+;; On entry, DE points to the end of the loaded list (the TFTP write pointer).
+;; ############################################################################
+
+    .area _NONRESIDENT
+
+expand_snapshot_list:
+
+    ld   a, (nbr_snapshots)
+    or   a, a
+    ret  z                         ;; empty list: nothing to expand
+
+    ex   de, hl                    ;; HL := end of loaded data
+    ld   de, #snapshot_array
+    sbc  hl, de                    ;; C is clear after OR above
+    ld   b, h
+    ld   c, l                      ;; BC := size of compressed list
+    add  hl, de
+    dec  hl                        ;; HL := last byte of compressed list
+    ld   de, #0xffff
+    lddr
+    inc  de                        ;; DE := start of moved list
+    push de
+
+    ld   b, a                      ;; A is still nbr_snapshots
+    ld   l, a
+    ld   h, #0
+    add  hl, hl
+    ld   de, #snapshot_array
+    add  hl, de
+    ex   de, hl                    ;; DE := first file name, after pointers
+    pop  hl
+    ld   (hl), #0                  ;; the first name has no previous one
+    ld   ix, #snapshot_array
+
+expand_name_loop:
+
+    call expand_check_room
+
+    ld   0(ix), e
+    ld   1(ix), d
+
+    ;; ------------------------------------------------------------------------
+    ;; copy leading characters from the previous name (none for the first)
+    ;; ------------------------------------------------------------------------
+
+    ld   a, (hl)
+    inc  hl
+    or   a, a
+    jr   z, expand_suffix_loop
+
+    push bc
+    push hl
+    ld   c, a
+    ld   b, #0
+    ld   l, -2(ix)
+    ld   h, -1(ix)
+    ldir
+    pop  hl
+    pop  bc
+
+    call expand_check_room
+
+    ;; ------------------------------------------------------------------------
+    ;; DE <= HL here, and stays so while the suffix is copied
+    ;; ------------------------------------------------------------------------
+
+expand_suffix_loop:
+
+    ld   a, (hl)
+    inc  hl
+    or   a, a
+    jr   z, expand_extension
+    ld   (de), a
+    inc  de
+    jr   expand_suffix_loop
+
+expand_extension:
+
+    push bc
+    push hl
+    ld   hl, #z80_extension
+    ld   bc, #z80_extension_end - z80_extension
+    ldir
+    pop  hl
+    pop  bc
+
+    inc  ix
+    inc  ix
+    djnz expand_name_loop
+
+    ret
+
+    ;; ------------------------------------------------------------------------
+    ;; fail unless DE (write pointer) <= HL (next compressed byte to read)
+    ;; ------------------------------------------------------------------------
+
+expand_check_room:
+
+    or   a, a
+    sbc  hl, de
+    add  hl, de                    ;; C set if HL < DE
+    ret  nc
+    ld   a, #FATAL_FILE_TOO_LARGE
+    jp   fail
+
+z80_extension:
+    .ascii ".z80"
+    .db    0
+z80_extension_end:
+
 ;; ############################################################################
 ;; print_str
 ;;
@@ -145,8 +269,19 @@ no_end_of_segment:
 
     .area _STAGE2_ENTRY
 
+    ;; ------------------------------------------------------------------------
+    ;; The resident loader (resident.asm) follows this jump, and the
+    ;; remainder of the menu is placed in non-resident RAM.
+    ;; ------------------------------------------------------------------------
+
+    jp   run_menu   ;; DE is the end of the loaded menu.bin
+
+    .area _NONRESIDENT
+
 run_menu:
 
+    call expand_snapshot_list
+
     ;; ------------------------------------------------------------------------
     ;; set up menu colours
     ;; ------------------------------------------------------------------------
@@ -185,7 +320,7 @@ run_menu:
     ;;
     ;; C = currently highlighted entry (0..254)
     ;; D = display offset (index of first displayed snapshot name, < E)
-    ;; E = total number of snapshots (0..255)
+    ;; E = number of snapshots in the current page (1..255)
     ;; ========================================================================
 
     ld   c, #0
@@ -205,30 +340,31 @@ menu_loop:
     push bc
     push de
 
-    ;; Set up B to be ((last index to display) + 1)
-
     ld   c, d     ;; C=first index
-    ld   a, c
-    add  a, #DISPLAY_LINES
-    cp   a, e
-    ld   b, a
-    jr   c, redraw_menu_limit_set
-    ld   b, e
-redraw_menu_limit_set:
+    ld   b, #DISPLAY_LINES
 
     ld   de, #0x4141      ;; (2,1)
 
 redraw_menu_loop:
 
+    ;; ------------------------------------------------------------------------
+    ;; Lines after the last snapshot in the page are blanked, as a previously
+    ;; displayed page may have had more. z80_extension begins with a '.', so
+    ;; print_str pads the whole line with spaces. C stops at nbr_snapshots.
+    ;; ------------------------------------------------------------------------
+
+    ld   a, (nbr_snapshots)
+    cp   a, c
+    ld   hl, #z80_extension
+    jr   z, redraw_menu_line
     call get_filename_pointer
+    inc  c
+redraw_menu_line:
     call print_str
 
     inc  de    ;; skip first cell on each line
-    inc  c
 
-    ld   a, c
-    cp   a, b
-    jr   c, redraw_menu_loop
+    djnz redraw_menu_loop
 
     ;; ========================================================================
     ;; handle user input
@@ -254,35 +390,39 @@ redraw_menu_loop:
     jr   z, menu_hit_up
 
     ;; ========================================================================
-    ;; user hit something else than ENTER/UP/DOWN:
-    ;; select the first snapshot with that initial letter
+    ;; user hit something else than ENTER/UP/DOWN: select the first snapshot
+    ;; with that initial character ('0'..'9', 'A'..'Z'), as listed in
+    ;; snapshot_jump_table. Other keys select the first snapshot.
     ;; ========================================================================
 
-    ld   c, b ;; C will hold the result (selected index); B==0 after menu_erase_highlight
-    ld   b, l
-
-find_snapshot_for_key_lp:
-
-    ld   a, c
-    inc  a
-    cp   a, e          ;; ensure (C + 1) < E
-    jr   nc, menu_adjust
-
-    call get_filename_pointer
-
-    ld   a, (hl)
+    ld   a, l
+    sub  a, #'0'
+    jr   c, menu_jump_first
+    cp   a, #10
+    jr   c, menu_jump_digit
+    sub  a, #'A' - '0' - 10
+menu_jump_digit:
+    cp   a, #JUMP_TABLE_ENTRIES
+    jr   c, menu_jump_lookup
+menu_jump_first:
+    xor  a, a
+menu_jump_lookup:
 
-    cp   a, #'a'
-    jr   c, not_lowercase_letter
-    and  a, #0xDF     ;; to upper case
-not_lowercase_letter:
+    add  a, a
+    ld   c, a                     ;; B==0 after menu_set_highlight
+    ld   hl, #snapshot_jump_table
+    add  hl, bc
 
+    ld   b, (hl)                  ;; page
+    inc  hl
+    ld   c, (hl)                  ;; index within page
+    ld   a, (current_page)
     cp   a, b
-    jr   nc, menu_adjust
-
-    inc  c
+    jr   z, menu_adjust
 
-    jr   find_snapshot_for_key_lp
+    ld   a, b
+    ld   l, c
+    jp   menu_load_page
 
     ;; ========================================================================
     ;; user hit DOWN: highlight next entry
@@ -293,7 +433,7 @@ menu_hit_down:
     ld   a, c
     inc  a
     cp   a, e
-    jr   nc, menu_loop
+    jp   nc, menu_next_page
 
     inc  c
 
@@ -307,7 +447,7 @@ menu_hit_up:
 
     ld   a, c
     or   a, a
-    jr   z, menu_loop
+    jp   z, menu_previous_page
 
     dec  c
 
@@ -377,17 +517,222 @@ menu_hit_enter:
     ;; send a TFTP request for the snapshot
     ;; ------------------------------------------------------------------------
 
-    call eth_init
+    call menu_eth_init
+
+    ;; ------------------------------------------------------------------------
+    ;; Restrict broadcasts to ARP requests for our IP address (eth_init above
+    ;; accepts all broadcasts, for BOOTP). Frames are then accepted if they
+    ;; are either unicast to our MAC address, or match a pattern of the
+    ;; Ethertype (bytes 12..13) and the ARP target protocol address (bytes
+    ;; 38..41). Other broadcasts are dropped by the ENC28J60, and never read
+    ;; over SPI.
+    ;; ------------------------------------------------------------------------
+
+    ld   e, #1                                 ;; bank 1: EPMM, EPMCS, ERXFCON
+    rst  enc28j60_select_bank
+
+    ld   hl, #0x0100 * 0x30 + OPCODE_WCR + (EPMM1 & REG_MASK)   ;; bytes 12..13
+    rst  enc28j60_write8plus8
+    ld   hl, #0x0100 * 0xc0 + OPCODE_WCR + (EPMM4 & REG_MASK)   ;; bytes 38..39
+    rst  enc28j60_write8plus8
+    ld   hl, #0x0100 * 0x03 + OPCODE_WCR + (EPMM5 & REG_MASK)   ;; bytes 40..41
+    rst  enc28j60_write8plus8
+
+    ld   hl, #0x0608                   ;; ETHERTYPE_ARP, in checksum byte order
+    ld   de, #_ip_config + IP_CONFIG_HOST_ADDRESS_OFFSET
+    ld   b, #IPV4_ADDRESS_SIZE / 2
+    call enc28j60_add_to_checksum_hl
+
+    ;; EPMCS is the complemented sum, high (first) byte in EPMCSH
+
+    ld   a, l
+    cpl
+    ld   l, h
+    ld   h, a
+    ld   a, l
+    cpl
+    ld   l, a
+    ld   a, #OPCODE_WCR + (EPMCSL & REG_MASK)
+    rst  enc28j60_write_register16
+
+    ld   hl, #0x0100 * (ERXFCON_UCEN + ERXFCON_PMEN + ERXFCON_CRCEN) + OPCODE_WCR + (ERXFCON & REG_MASK)
+    rst  enc28j60_write8plus8
+
+    ld   e, #0                       ;; bank 0 is expected selected (eth_create)
+    rst  enc28j60_select_bank
 
     pop  de
-    call tftp_request_snapshot
+    call resident_request_snapshot
 
     ;; ------------------------------------------------------------------------
-    ;; let the main loop handle the response
+    ;; let the resident main loop handle the response
     ;; ------------------------------------------------------------------------
 
+    ld   sp, #_stack_top
+    jp   resident_main_loop
+
+
+    .area _NONRESIDENT
+
+    ;; ========================================================================
+    ;; user hit DOWN at the last entry of a page: load the next page, if any,
+    ;; and highlight its first entry
+    ;; ========================================================================
+
+menu_next_page:
+
+    ld   a, (current_page)
+    inc  a
+    ld   hl, #nbr_pages
+    cp   a, (hl)
+    jp   nc, menu_loop
+
+    ld   l, #0                     ;; highlight the first entry
+    jr   menu_load_page
+
+    ;; ========================================================================
+    ;; user hit UP at the first entry of a page: load the previous page, if
+    ;; any, and highlight its last entry
+    ;; ========================================================================
+
+menu_previous_page:
+
+    ld   a, (current_page)
+    sub  a, #1
+    jp   c, menu_loop
+
+    ld   l, #0xff                  ;; highlight the last entry
+
+    ;; FALL THROUGH to menu_load_page
+
+    ;; ========================================================================
+    ;; load page A of the snapshot list ("menuXX.bin", XX being A in hex),
+    ;; using the TFTP client in the ROM; menu_page_loader resumes the menu,
+    ;; highlighting entry L (or the last entry, if there are fewer)
+    ;; ========================================================================
+
+menu_load_page:
+
+    ld   h, a
+    ld   (menu_page_highlight), hl   ;; also sets current_page
+
+    ld   hl, #page_file_name + 4
+    rrca
+    rrca
+    rrca
+    rrca
+    call menu_hex_digit
+    ld   a, (current_page)
+    call menu_hex_digit
+
+    call menu_eth_init
+
+    xor  a, a                     ;; low byte of _tftp_blksize must be zero for
+    ld   (_tftp_blksize), a       ;; tftp_read_request (PREPARE_TFTP_READ_REQUEST)
+
+    ld   hl, #nbr_snapshots
+    ld   (_tftp_write_pos), hl
+    ld   hl, #menu_page_loader
+    ld   de, #page_file_name
+    call tftp_read_request
+
+    ld   sp, #_stack_top
     jp   main_loop
 
+;; ############################################################################
+;; menu_page_loader
+;;
+;; TFTP state for loading a page of the snapshot list to nbr_snapshots, like
+;; tftp_state_menu_loader (stack.asm). When the last packet has been loaded,
+;; the page is expanded, and the menu resumes.
+;; ############################################################################
+
+menu_page_loader:
+
+    ;; ------------------------------------------------------------------------
+    ;; BC equals _tftp_blksize for all DATA packets except the last one,
+    ;; and is never larger. C flag is clear here (OR in tftp_state_loop).
+    ;; ------------------------------------------------------------------------
+
+    ld   hl, (_tftp_blksize)
+    sbc  hl, bc ;; Z set for a full packet (LDIR below preserves it)
+
+    ld   h, d   ;; fail if the data would run past the top of RAM
+    ld   l, e
+    add  hl, bc ;; preserves Z
+    ld   a, #FATAL_FILE_TOO_LARGE
+    jp   c, fail
+
+    ld   hl, #_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_SIZE + TFTP_HEADER_SIZE
+    ldir
+
+    ret  z
+
+    ld   sp, #_stack_top
+
+    call expand_snapshot_list
+
+    ld   a, (nbr_snapshots)
+    ld   e, a
+    ld   d, #0
+
+    ld   a, (menu_page_highlight)
+    cp   a, e
+    jr   c, menu_page_highlight_set
+    ld   a, e
+    dec  a
+menu_page_highlight_set:
+    ld   c, a
+
+    jp   menu_adjust
+
+;; ############################################################################
+;; menu_hex_digit
+;;
+;; Store the lower four bits of A as an upper-case hex digit at (HL++).
+;; Destroys AF.
+;; ############################################################################
+
+menu_hex_digit:
+
+    and  a, #0x0f
+    add  a, #0x90
+    daa
+    adc  a, #0x40
+    daa
+    ld   (hl), a
+    inc  hl
+    ret
+
+;; ############################################################################
+;; menu_eth_init
+;;
+;; Re-initialize the ENC28J60, and read received frames from the start of its
+;; receive buffer again (eth_init leaves _next_frame as it is).
+;; ############################################################################
+
+menu_eth_init:
+
+    call eth_init
+    ld   hl, #ENC28J60_RXBUF_START
+    ld   (_next_frame), hl
+    ret
+
+;; ----------------------------------------------------------------------------
+;; Index of the entry to highlight when a loaded page is displayed (0xff for
+;; the last one), directly followed by the current page of the snapshot list
+;; (so both can be set with a single 16-bit write)
+;; ----------------------------------------------------------------------------
+
+menu_page_highlight:
+    .db  0
+current_page:
+    .db  0
+
+page_file_name:
+    .ascii "menuXX.bin"
+    .db   0
+
 
     .area _NONRESIDENT
 
@@ -0,0 +1,1594 @@
+;;
+;; Module resident:
+;;
+;; Stage 2 snapshot loading over TFTP, using windows of several DATA packets
+;; per ACK (RFC 7440). Runs from RAM that is preserved during loading.
+;;
+;; Part of SpeccyBoot <https://github.com/patrikpersson/speccyboot>
+;;
+;; ----------------------------------------------------------------------------
+;;
+;; Copyright (c) 2009-  Patrik Persson
+;;
+;; Permission is hereby granted, free of charge, to any person
+;; obtaining a copy of this software and associated documentation
+;; files (the "Software"), to deal in the Software without
+;; restriction, including without limitation the rights to use,
+;; copy, modify, merge, publish, distribute, sublicense, and/or sell
+;; copies of the Software, and to permit persons to whom the
+;; Software is furnished to do so, subject to the following
+;; conditions:
+;;
+;; The above copyright notice and this permission notice shall be
+;; included in all copies or substantial portions of the Software.
+;;
+;; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+;; EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+;; OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+;; NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+;; HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+;; WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+;; FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+;; OTHER DEALINGS IN THE SOFTWARE.
+
+    .module resident
+
+    .include "resident.inc"
+
+    .include "arp.inc"
+    .include "context_switch.inc"
+    .include "enc28j60.inc"
+    .include "eth.inc"
+    .include "globals.inc"
+    .include "spi.inc"
+    .include "tftp.inc"
+    .include "udp_ip.inc"
+    .include "util.inc"
+    .include "z80_loader.inc"
+
+;; ----------------------------------------------------------------------------
+;; UDP length of a DATA packet with a full block of default size
+;; ----------------------------------------------------------------------------
+
+TFTP_DEFAULT_UDP_LENGTH = UDP_HEADER_SIZE + TFTP_HEADER_SIZE + TFTP_DEFAULT_BLKSIZE
+
+;; ----------------------------------------------------------------------------
+;; Snapshot files of this many 256-byte units or more are rejected, if the
+;; OACK reports their size ("tsize", RFC 2349). The largest snapshot is a
+;; version 3 128K one, with a 87-byte header and eight uncompressed pages of
+;; 16384 + 3 bytes: 131183 bytes, just below 0x0201 * 256 = 131328. Pages
+;; that compress to more than 16384 bytes are not supported (they are stored
+;; uncompressed instead).
+;; ----------------------------------------------------------------------------
+
+SNAPSHOT_SIZE_LIMIT_256 = 0x0201
+
+;; ============================================================================
+
+    .area _DATA
+
+;; ----------------------------------------------------------------------------
+;; Number of DATA packets per window (1 unless changed by an OACK), directly
+;; followed by the (low byte of the) block number that closes the current
+;; window
+;; ----------------------------------------------------------------------------
+
+tftp_windowsize:
+    .ds   1
+tftp_window_end:
+    .ds   1
+
+;; ----------------------------------------------------------------------------
+;; UDP length of a DATA packet with a full block (network order)
+;; ----------------------------------------------------------------------------
+
+tftp_full_udp_length:
+    .ds   2
+
+;; ----------------------------------------------------------------------------
+;; ENC28J60 address of the frame currently being received
+;; ----------------------------------------------------------------------------
+
+resident_frame:
+    .ds   2
+
+;; ----------------------------------------------------------------------------
+;; Smoothed round-trip time and re-transmission time-out, in units of
+;; _timer_tick_count (10ms), followed by a flag that is non-zero when
+;; round-trip times cannot be measured (after a re-transmission, until the
+;; next ACK). See resident_measure_rtt.
+;;
+;; These are followed by the remaining boot telemetry, sent by
+;; resident_send_telemetry in this layout (all 16-bit values little-endian):
+;;
+;;   number of re-transmissions (modulo 256)
+;;   number of frames received that did not carry an expected OACK or DATA
+;;     packet (ARP, duplicates, bad checksums, other traffic)
+;;   time from the read request to the first DATA packet
+;;   time from the read request to the last DATA packet (resident_clock)
+;;
+;; Times are in units of _timer_tick_count (10ms).
+;; ----------------------------------------------------------------------------
+
+resident_srtt:
+    .ds   1
+resident_rto:
+    .ds   1
+resident_rtt_ambiguous:
+    .ds   1
+telemetry_retransmissions:
+    .ds   1
+telemetry_frames_unused:
+    .ds   2
+telemetry_request_ticks:
+    .ds   2
+resident_clock:
+    .ds   2
+telemetry_end:
+
+;; ----------------------------------------------------------------------------
+;; Payload sum from the DMA controller (see resident_dma_checksum)
+;; ----------------------------------------------------------------------------
+
+resident_payload_sum:
+    .ds   2
+
+
+;; ############################################################################
+;; resident_main_loop
+;;
+;; Like main_loop (stack.asm), except for IP packets: these are passed to
+;; resident_ip_receive below. Also, all frames counted by EPKTCNT are
+;; processed as a batch, before EPKTCNT is polled again (with bank 1 selected
+;; for it).
+;; ############################################################################
+
+    .area _RESIDENT
+
+resident_main_loop:
+
+    ;; ------------------------------------------------------------------------
+    ;; Spin until a frame is received, re-transmitting the last critical
+    ;; frame when _timer_tick_count exceeds resident_rto. Bank 1 stays
+    ;; selected while spinning: only the re-transmission (which leaves bank 0
+    ;; selected) requires selecting it again.
+    ;; ------------------------------------------------------------------------
+
+    ld    e, #1       ;; bank 1 for EPKTCNT
+    rst   enc28j60_select_bank
+
+resident_poll:
+
+    ld    de, #(EPKTCNT & REG_MASK) + (8 << 8)    ;; EPKTCNT is an ETH register
+    call  enc28j60_read_register
+
+    or    a, a
+    jr    nz, resident_packets             ;; NZ means packets have been received
+
+    ld    hl, (_timer_tick_count)
+    ld    a, h
+    or    a, a                         ;; H >= 1 means time-out
+    jr    nz, resident_timeout
+
+    ld    a, (resident_rto)
+    cp    a, l
+    jr    nc, resident_poll
+
+resident_timeout:
+    call  resident_retransmit
+
+    jr    resident_main_loop
+
+resident_packets:
+
+    push  af                              ;; number of frames in this batch
+
+    ld    e, b                            ;; B == 0 from enc28j60_read_register
+    rst   enc28j60_select_bank
+
+resident_packet:
+
+    ;; ------------------------------------------------------------------------
+    ;; Decrease EPKTCNT, set ERDPT (bank 0) to _next_frame, and read the
+    ;; administrative header. The frame is kept in the receive buffer until
+    ;; ERXRDPT is advanced, so resident_ip_receive can read it again.
+    ;; ------------------------------------------------------------------------
+
+    ld    hl, #0x0100 * ECON2_PKTDEC + OPCODE_BFS + (ECON2 & REG_MASK)
+    rst   enc28j60_write8plus8
+
+    ld    hl, (telemetry_frames_unused)  ;; decreased by resident_read_payload
+    inc   hl
+    ld    (telemetry_frames_unused), hl
+
+    ld    hl, (_next_frame)
+    ld    (resident_frame), hl
+
+resident_read_frame:                      ;; HL = frame to read (again)
+
+    ld    a, #OPCODE_WCR + (ERDPTL & REG_MASK)
+    rst   enc28j60_write_register16
+
+    ld    de, #ETH_ADM_HEADER_SIZE
+    ld    hl, #eth_adm_header
+    call  enc28j60_read_memory
+
+    ;; ------------------------------------------------------------------------
+    ;; pass packet to IP or ARP, if ethertype matches
+    ;; ------------------------------------------------------------------------
+
+    ld    hl, (eth_adm_header_ethertype)
+    ld    a, l
+    sub   a, #8
+    jr    nz, resident_packet_done   ;; neither IP nor ARP -- ignore
+    or    a, h
+    jr    nz, resident_packet_not_ip
+
+    call  resident_ip_receive
+    xor   a, a                       ;; avoid matching ARP below
+
+resident_packet_not_ip:
+    cp    a, #6
+    call  z, arp_receive
+
+resident_packet_done:
+
+    ;; ------------------------------------------------------------------------
+    ;; Advance ERXRDPT to just before _next_frame (bank 0 is selected, as in
+    ;; main_packet_done). If _next_frame is at the start of the receive
+    ;; buffer, that means its last (odd) address.
+    ;;
+    ;; This is done for every frame, rather than once per batch: the receive
+    ;; buffer must make room for the next window while the last payload of
+    ;; the current one is read (see TFTP_WINDOWSIZE).
+    ;; ------------------------------------------------------------------------
+
+    ld    hl, (_next_frame)
+    ld    bc, #ENC28J60_RXBUF_END
+    add   hl, bc
+    call  resident_wrap_rx_address
+
+    ld    a, #OPCODE_WCR + (ERXRDPTL & REG_MASK)
+    rst   enc28j60_write_register16
+
+    pop   af
+    dec   a
+    jr    z, resident_main_loop
+    push  af
+    jr    resident_packet
+
+
+;; ############################################################################
+;; resident_ip_receive
+;;
+;; Receive an IP packet, like ip_receive, but only accept TFTP packets for
+;; the resident client port. The UDP and TFTP headers are read first, so that
+;; an ACK can be sent before the payload is read. The server can then send
+;; the next window while the payload is transferred over SPI.
+;;
+;; The UDP checksum is verified before the packet is acknowledged, with the
+;; payload summed by the ENC28J60 DMA controller in its receive buffer (see
+;; resident_verify_checksum). A packet with a bad checksum is dropped, and
+;; the previous block acknowledged, so that the server resends the window
+;; from the dropped packet.
+;;
+;; If the payload is then garbled on its way over SPI, resident_read_payload
+;; reads it again from the receive buffer, where the frame is kept until
+;; ERXRDPT is advanced. This does not involve any ACK or round-trip time.
+;; ############################################################################
+
+resident_ip_receive:
+
+    ;; ------------------------------------------------------------------------
+    ;; IPv4 header, without options (which ip_receive would skip). Its
+    ;; checksum is not verified here: the fields used (protocol and addresses)
+    ;; are covered by the UDP checksum, through the pseudo header.
+    ;; ------------------------------------------------------------------------
+
+    ld    de, #IPV4_HEADER_SIZE
+    call  enc28j60_read_memory_to_rxframe
+
+    ld    a, (_rx_frame + IPV4_HEADER_OFFSETOF_VERSION_AND_LENGTH)
+    cp    a, #0x45                           ;; IPv4, header size 20 bytes
+    ret   nz
+
+    ld    a, (_rx_frame + IPV4_HEADER_OFFSETOF_PROT)
+    cp    a, #IP_PROTOCOL_UDP
+    ret   nz
+
+    ;; ------------------------------------------------------------------------
+    ;; UDP and TFTP headers. The destination IP address is not checked: the
+    ;; random client port makes a mix-up unlikely enough.
+    ;; ------------------------------------------------------------------------
+
+    ld    de, #UDP_HEADER_SIZE + TFTP_HEADER_SIZE
+    ld    hl, #_rx_frame + IPV4_HEADER_SIZE
+    call  enc28j60_read_memory
+
+    ld    hl, (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_DST_PORT)
+    ld    a, h
+    cp    a, #UDP_PORT_RESIDENT_CLIENT
+    ret   nz
+    ld    a, (_tftp_client_port)
+    cp    a, l
+    ret   nz
+
+    ;; ------------------------------------------------------------------------
+    ;; Only accept OACK and DATA packets; anything else is a fatal error.
+    ;; The OACK is handled by non-resident code. Once an OACK or the first DATA
+    ;; block has been accepted, the JP Z below is redirected to a RET, so that
+    ;; any repeated or late OACK is ignored.
+    ;; ------------------------------------------------------------------------
+
+    ld    hl, (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_SIZE + TFTP_OFFSET_OF_OPCODE)
+    ld    a, h
+    cp    a, #TFTP_OPCODE_OACK
+resident_oack_jump:
+    jp    z, resident_receive_oack
+    sub   a, #TFTP_OPCODE_DATA
+    or    a, l
+
+    ld    a, #FATAL_FILE_NOT_FOUND
+    jp    nz, fail
+
+    ;; ------------------------------------------------------------------------
+    ;; check block number, as in HANDLE_TFTP_PACKET
+    ;; ------------------------------------------------------------------------
+
+    ld    a, (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_SIZE + TFTP_OFFSET_OF_BLOCKNO + 1)
+    ld    hl, #expected_tftp_block_no
+    cp    a, (hl)
+    jr    z, resident_blk_nbr_expected
+
+    ;; ------------------------------------------------------------------------
+    ;; received == expected-1 means an ACK was lost: acknowledge again, and
+    ;; start a new window from there (RFC 7440, section 4). Other block
+    ;; numbers are ignored.
+    ;; ------------------------------------------------------------------------
+
+    inc   a
+    cp    a, (hl)
+    ret   nz
+
+    ;; FALL THROUGH to resident_ack
+
+
+;; ############################################################################
+;; resident_ack
+;;
+;; Acknowledge the received packet, and set the end of the next window.
+;; ############################################################################
+
+resident_ack:
+
+    ld    a, (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_SIZE + TFTP_OFFSET_OF_BLOCKNO + 1)
+    ld    hl, #tftp_windowsize
+    add   a, (hl)
+    inc   hl
+    ld    (hl), a                          ;; tftp_window_end
+
+    jp    resident_send_ack
+
+
+resident_blk_nbr_expected:
+
+    call  resident_verify_checksum
+    jr    nz, resident_reject
+
+    call  resident_measure_rtt
+
+    ;; ------------------------------------------------------------------------
+    ;; Acknowledge the packet closing the window, and a packet shorter than a
+    ;; full block (the last one), before reading the payload. Any other
+    ;; packet is consumed without ACK.
+    ;; ------------------------------------------------------------------------
+
+    ld    hl, #tftp_window_end
+    cp    a, (hl)
+    jr    z, resident_early_ack
+
+    ld    hl, (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_LENGTH)
+    ld    de, (tftp_full_udp_length)
+    or    a, a
+    sbc   hl, de
+    jr    z, resident_payload
+
+resident_early_ack:
+    call  resident_ack
+
+resident_payload:
+    call  resident_read_payload
+
+    ld    hl, #expected_tftp_block_no
+    inc   (hl)
+
+    call  tftp_receive_data
+
+    ;; ------------------------------------------------------------------------
+    ;; kilobytes_expected is one more than the actual number (see
+    ;; resident_s_header), so the context switch is made here instead
+    ;; ------------------------------------------------------------------------
+
+    ld    hl, (kilobytes_loaded)         ;; L := loaded, H := expected
+    inc   l
+    ld    a, l
+    cp    a, h
+    ret   nz
+
+    jp    resident_send_telemetry
+
+    ;; ------------------------------------------------------------------------
+    ;; Bad UDP checksum, found before this packet was acknowledged:
+    ;; acknowledge the previous block (block number in network order)
+    ;; ------------------------------------------------------------------------
+
+resident_reject:
+
+    ld    hl, #_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_SIZE + TFTP_OFFSET_OF_BLOCKNO + 1
+    ld    a, (hl)
+    dec   (hl)
+    or    a, a
+    jr    nz, resident_ack
+    dec   hl
+    dec   (hl)
+    jr    resident_ack
+
+
+;; ############################################################################
+;; Resident kernel
+;;
+;; Code for the resident loader that does not fit in _RESIDENT. It is kept in
+;; the font buffer, after the digits: only the digits are needed for the
+;; progress display while a snapshot is loaded. The code is assembled here, in
+;; the non-resident area, and copied into place by resident_request_snapshot.
+;; It must therefore only refer to its own labels relative to
+;; resident_kernel_image, as in the assignments following it.
+;; ############################################################################
+
+RESIDENT_KERNEL = _font_data + ('9' + 1 - ' ') * 8
+
+    .area _NONRESIDENT
+
+resident_kernel_image:
+
+;; ############################################################################
+;; resident_verify_checksum
+;;
+;; Verify the UDP checksum of the packet whose headers resident_ip_receive has
+;; read, before its payload is read. The payload is summed by the ENC28J60 DMA
+;; controller, in the receive buffer (resident_dma_checksum). The pseudo
+;; header, UDP header, and TFTP header are added from _rx_frame, with the
+;; pseudo header fields patched into the IPv4 header (no longer needed):
+;;
+;;   offset  8: TTL := 0, followed by protocol
+;;   offset 10: IP header checksum := UDP length
+;;   offset 12: source and destination addresses
+;;
+;; Returns Z if the checksum is OK or was not given.
+;; ############################################################################
+
+kernel_verify_checksum:
+
+    ld    hl, (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_CHECKSUM)
+    ld    a, h
+    or    a, l
+    ret   z
+
+    xor   a, a
+    ld    (_rx_frame + IPV4_HEADER_OFFSETOF_TTL), a
+
+    call  resident_payload_length
+    ld    (_rx_frame + IPV4_HEADER_OFFSETOF_CHECKSUM), hl
+    ld    hl, #0                         ;; sum of an empty payload
+    call  nz, resident_dma_checksum
+
+    ld    b, #(IPV4_HEADER_SIZE - IPV4_HEADER_OFFSETOF_TTL + UDP_HEADER_SIZE + TFTP_HEADER_SIZE) / 2
+    ld    de, #_rx_frame + IPV4_HEADER_OFFSETOF_TTL
+    call  enc28j60_add_to_checksum_hl
+
+    ld    a, h
+    and   a, l
+    inc   a                  ;; if both bytes are 0xff, A will now become zero
+kernel_ret:
+    ret
+
+
+;; ############################################################################
+;; resident_payload_length
+;;
+;; Returns DE = TFTP payload length, with Z set if it is zero, and HL = UDP
+;; length (network order).
+;; ############################################################################
+
+kernel_payload_length:
+
+    ld    hl, (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_LENGTH)
+    ld    a, h                           ;; HL in network order
+    sub   a, #UDP_HEADER_SIZE + TFTP_HEADER_SIZE
+    ld    e, a
+    ld    a, l
+    sbc   a, #0
+    ld    d, a
+    or    a, e
+    ret
+
+
+;; ############################################################################
+;; resident_dma_checksum
+;;
+;; Have the DMA controller sum DE (non-zero) payload bytes in the receive
+;; buffer, and return the sum in HL (in the byte order of
+;; enc28j60_add_to_checksum), also stored in resident_payload_sum. ERDPT is
+;; not affected.
+;; ############################################################################
+
+kernel_dma_checksum:
+
+    call  resident_payload_address
+    push  hl
+
+    dec   de
+    add   hl, de
+    call  resident_wrap_rx_address
+    ld    a, #OPCODE_WCR + (EDMANDL & REG_MASK)
+    rst   enc28j60_write_register16
+
+    pop   hl
+    ld    a, #OPCODE_WCR + (EDMASTL & REG_MASK)
+    rst   enc28j60_write_register16
+
+    ld    hl, #0x0100 * (ECON1_CSUMEN | ECON1_DMAST) + OPCODE_BFS + (ECON1 & REG_MASK)
+    rst   enc28j60_write8plus8
+
+    ld    de, #(ECON1 & REG_MASK) + (8 << 8)      ;; ECON1 is an ETH register
+kernel_wait_for_dma:
+    call  enc28j60_read_register
+    and   a, #ECON1_DMAST
+    jr    nz, kernel_wait_for_dma
+
+    ;; ------------------------------------------------------------------------
+    ;; EDMACS holds the complemented sum, with the first byte in EDMACSH
+    ;; ------------------------------------------------------------------------
+
+    ld    e, #EDMACSH & REG_MASK
+    call  enc28j60_read_register
+    cpl
+    ld    l, a
+    dec   e                              ;; EDMACSL
+    call  enc28j60_read_register
+    cpl
+    ld    h, a
+
+    ld    (resident_payload_sum), hl
+    ret
+
+
+;; ############################################################################
+;; resident_payload_address
+;;
+;; Address of the TFTP payload in the receive buffer, 52 bytes into the frame.
+;; The receive buffer is circular, so the address is wrapped around
+;; ENC28J60_RXBUF_END, like the ENC28J60 does when reading it. Destroys BC.
+;; ############################################################################
+
+kernel_payload_address:
+
+    ld    hl, (resident_frame)
+    ld    bc, #ETH_ADM_HEADER_SIZE + IPV4_HEADER_SIZE + UDP_HEADER_SIZE + TFTP_HEADER_SIZE
+    add   hl, bc
+
+    ;; FALL THROUGH to resident_wrap_rx_address
+
+
+;; ############################################################################
+;; resident_wrap_rx_address
+;;
+;; Wrap an address HL, below 2 * (ENC28J60_RXBUF_END + 1), around the end of
+;; the receive buffer. Destroys BC.
+;; ############################################################################
+
+kernel_wrap_rx_address:
+
+    ld    bc, #-(ENC28J60_RXBUF_END + 1)
+    add   hl, bc
+    ret   c
+    sbc   hl, bc                         ;; C is clear here: undo the ADD
+    ret
+
+
+;; ############################################################################
+;; resident_measure_rtt
+;;
+;; Called for every DATA packet with the expected block number. The time
+;; since the last transmission (usually the ACK closing the previous window)
+;; is taken as a round-trip time sample, so it includes the time for reading
+;; the payloads before it. The time-out is then set to twice the smoothed
+;; round-trip time, plus RESIDENT_RTO_MIN, up to 2.55s.
+;;
+;; No sample is taken after a re-transmission (Karn's algorithm): the packet
+;; could then be an answer to either transmission.
+;;
+;; Returns A = (low byte of) the block number of the packet.
+;; ############################################################################
+
+kernel_measure_rtt:
+
+    ld    a, (resident_rtt_ambiguous)
+    or    a, a
+    jr    nz, kernel_measure_rtt_done
+
+    ld    hl, (_timer_tick_count)
+    ld    a, h
+    or    a, a
+    ld    a, l
+    jr    z, kernel_rtt_sample
+    ld    a, #0xff
+kernel_rtt_sample:
+
+    ld    hl, #resident_srtt
+    add   a, (hl)
+    rra                                  ;; 9-bit sum, halved
+    ld    (hl), a                        ;; srtt := (srtt + sample) / 2
+
+    add   a, a
+    jr    c, kernel_rto_max
+    add   a, #RESIDENT_RTO_MIN
+    jr    nc, kernel_rto_set
+kernel_rto_max:
+    ld    a, #0xff
+kernel_rto_set:
+    inc   hl
+    ld    (hl), a                        ;; resident_rto
+
+kernel_measure_rtt_done:
+    ld    a, (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_SIZE + TFTP_OFFSET_OF_BLOCKNO + 1)
+    ret
+
+
+;; ############################################################################
+;; resident_retransmit
+;;
+;; Re-transmit the last critical frame, and double the time-out (exponential
+;; back-off, up to 2.55s).
+;; ############################################################################
+
+kernel_retransmit:
+
+    call  resident_clock_update
+
+    ld    hl, #resident_rto
+    ld    a, (hl)
+    add   a, a
+    jr    nc, kernel_rto_doubled
+    ld    a, #0xff
+kernel_rto_doubled:
+    ld    (hl), a
+    inc   hl
+    ld    (hl), a                        ;; resident_rtt_ambiguous := non-zero
+    inc   hl
+    inc   (hl)                           ;; telemetry_retransmissions
+
+    ld    hl, (_end_of_critical_frame)
+    ld    de, #ENC28J60_TXBUF1_START
+    ld    a, #WARNING_RETRANSMITTED       ;; border colour for perform_transmission
+    jp    perform_transmission
+
+
+;; ############################################################################
+;; resident_send_ack
+;;
+;; Send an ACK (tftp_ack). Round-trip times are measured from here.
+;; ############################################################################
+
+kernel_send_ack:
+
+    xor   a, a
+    ld    (resident_rtt_ambiguous), a
+
+    call  resident_clock_update
+
+    jp    tftp_ack
+
+
+;; ############################################################################
+;; resident_clock_update
+;;
+;; Add _timer_tick_count to resident_clock. Called before every transmission
+;; of the resident loader (which resets _timer_tick_count), so resident_clock
+;; then holds the time since the read request was sent. ARP replies also
+;; reset _timer_tick_count: the time from the previous transmission to such a
+;; reply is not counted.
+;;
+;; Returns HL = resident_clock. Destroys DE.
+;; ############################################################################
+
+kernel_clock_update:
+
+    ld    hl, (_timer_tick_count)
+    ld    de, (resident_clock)
+    add   hl, de
+    ld    (resident_clock), hl
+    ret
+
+
+;; ############################################################################
+;; resident_read_payload
+;;
+;; Read the TFTP payload, following the headers read by resident_ip_receive,
+;; into _rx_frame. When a checksum was given, the payload is summed as it is
+;; read, and the sum compared to resident_payload_sum: if they differ, the
+;; data was garbled on its way over SPI, and the payload is read again from
+;; the receive buffer (which resident_verify_checksum has found to be OK).
+;;
+;; Every frame with a payload read here is subtracted from
+;; telemetry_frames_unused (counted up in resident_packet).
+;; ############################################################################
+
+kernel_read_payload:
+
+    ld    hl, (telemetry_frames_unused)
+    dec   hl
+    ld    (telemetry_frames_unused), hl
+
+kernel_read_payload_again:
+
+    call  resident_payload_length
+    ret   z
+
+    ld    hl, #_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_SIZE + TFTP_HEADER_SIZE
+    call  resident_read_memory
+
+    ld    hl, (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_CHECKSUM)
+    ld    a, h
+    or    a, l
+    ret   z
+
+    exx
+    push  hl                             ;; sum from resident_read_memory
+    exx
+    pop   hl
+    ld    de, (resident_payload_sum)
+    or    a, a
+    sbc   hl, de
+    ret   z
+
+    call  resident_payload_address
+    ld    a, #OPCODE_WCR + (ERDPTL & REG_MASK)
+    rst   enc28j60_write_register16
+
+    jr    kernel_read_payload_again
+
+
+;; ############################################################################
+;; resident_read_memory
+;;
+;; Read DE (non-zero) bytes from ERDPT to HL, like enc28j60_read_memory, but
+;; with the SPI bit reads inlined, two bytes per iteration: 423.5 T-states per
+;; byte, compared to 466.5 for enc28j60_read_memory. The checksum of the
+;; bytes is returned in HL', rather than added to _ip_checksum.
+;;
+;; The UDP checksum is verified by the DMA controller (resident_dma_checksum,
+;; about 9300 T-states for a 1024-byte payload), but that only covers the
+;; frame in the receive buffer. The bit-banged SPI transfer from there to the
+;; Z80 has no error detection of its own, so the payload is summed here too:
+;; resident_read_payload compares the two sums, and reads the payload again
+;; from the buffer on a mismatch. Without this sum, a bit garbled on SPI would
+;; end up in the snapshot unnoticed. It costs 47 T-states per word (400 per
+;; byte without it).
+;;
+;; Destroys AF, BC, DE, HL, AF', BC', DE'.
+;; ############################################################################
+
+kernel_read_memory:
+
+    ld    c, #OPCODE_RBM
+    rst   spi_write_byte
+
+    push  de                             ;; byte count, for the odd byte below
+    push  de
+    exx
+    pop   bc
+    srl   b
+    rr    c                              ;; BC' := number of 16-bit words
+    dec   bc
+    inc   b                              ;; B' := outer loop count
+    inc   c                              ;; C' := inner loop count (0 = 256)
+    ld    hl, #0                         ;; HL' := checksum
+    ld    a, b
+    or    a, c                           ;; clears carry for the checksum
+    ex    af, af'
+    ld    a, b
+    or    a, c
+    exx
+
+    ld    bc, #0x0100 * (SPI_IDLE + SPI_MOSI) + SPI_OUT
+    ld    d, #SPI_IDLE + SPI_SCK
+
+    jp    z, resident_read_memory_odd_byte
+
+    ;; =======================================================================
+    ;; each resident_read_memory_loop iteration (16 bits) takes 847 T-states
+    ;;   <=> 66.12 kbit/s  (48k machines @3.5MHz)
+    ;;       67.00 kbit/s  (128k machines @3.54690MHz)
+    ;; =======================================================================
+
+kernel_read_memory_loop:
+
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E                        ;; 376  (47 * 8)
+
+    ld    (hl), e                        ;;   7
+    inc   hl                             ;;   6
+    ld    a, e                           ;;   4
+    exx                                  ;;   4
+    ld    e, a                           ;;   4
+    exx                                  ;;   4
+
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E                        ;; 376  (47 * 8)
+
+    ld    (hl), e                        ;;   7
+    inc   hl                             ;;   6
+    ld    a, e                           ;;   4
+    exx                                  ;;   4
+    ld    d, a                           ;;   4
+
+    ex    af, af'                        ;;   4
+    adc   hl, de                         ;;  15
+    ex    af, af'                        ;;   4
+
+    dec   c                              ;;   4
+    exx                                  ;;   4
+
+    jp    nz, resident_read_memory_loop  ;;  10
+
+    exx
+    dec   b
+    exx
+    jp    nz, resident_read_memory_loop
+
+kernel_read_memory_odd_byte:
+
+    pop   af                             ;; F := low byte of count: C if odd
+    jr    nc, kernel_read_memory_done
+
+    call  spi_read_byte_to_c
+    ld    (hl), c
+    ld    a, c
+    exx
+    ld    e, a
+    ld    d, b                           ;; B' == 0 after the loop
+    ex    af, af'
+    adc   hl, de
+    ex    af, af'
+    exx
+
+kernel_read_memory_done:
+
+    exx
+    ex    af, af'
+    adc   hl, bc                         ;; final carry only (BC' is zero here)
+    exx
+
+    jp    enc28j60_end_transaction_and_return
+
+
+;; ############################################################################
+;; resident_send_telemetry
+;;
+;; Send the boot telemetry (resident_srtt .. telemetry_end) to
+;; UDP_PORT_TELEMETRY on the TFTP server, then make the context switch. The
+;; last DATA packet is still in _rx_frame, so this is sent as a reply to it,
+;; with its source port replaced.
+;; ############################################################################
+
+kernel_send_telemetry:
+
+    call  resident_clock_update
+
+    ld    hl, #((UDP_PORT_TELEMETRY & 0xff) << 8) + (UDP_PORT_TELEMETRY >> 8)
+    ld    (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_SRC_PORT), hl
+
+    ld    de, #(UDP_HEADER_SIZE + telemetry_end - resident_srtt) << 8  ;; network order
+    call  tftp_reply
+
+    ld    hl, #resident_srtt
+    ld    e, #telemetry_end - resident_srtt
+    rst   enc28j60_write_memory_small
+
+    call  ip_send
+
+    ;; FALL THROUGH to resident_context_switch
+
+
+;; ############################################################################
+;; resident_context_switch
+;;
+;; Same as PERFORM_CONTEXT_SWITCH (context_switch.inc), except that the
+;; evacuated data for 0x5800..0x62FF is restored by resident_restore below,
+;; rather than by the ROM. The restore code and the stored header fields it
+;; pops are copied to 0x6300, the last page of runtime data; that page is
+;; then restored by the ROM, in context_switch_restore_bytes_loop.
+;; ############################################################################
+
+kernel_context_switch:
+
+    di
+
+    ;; ------------------------------------------------------------------------
+    ;; 128k memory configuration and sound registers, as in
+    ;; PERFORM_CONTEXT_SWITCH
+    ;; ------------------------------------------------------------------------
+
+    ld    hl, #ram_config
+    ld    bc, #MEMCFG_ADDR
+    outd                                 ;; HL now points to kilobytes_expected
+
+    bit   7, (hl)
+    jr    z, kernel_context_switch_48k
+
+    ld    a, #16
+    ld    l, #<stored_snapshot_header + Z80_HEADER_OFFSET_HW_STATE_SND + 15
+    ld    d, #>SND_REG_SELECT
+
+kernel_context_switch_snd_reg_loop:
+    dec   a
+    ld    b, d
+    out   (c), a
+    ld    b, #>SND_REG_VALUE + 1
+    outd
+    or    a, a
+    jr    nz, kernel_context_switch_snd_reg_loop
+
+    ld    b, a
+    outd                                 ;; Z80_HEADER_OFFSET_HW_STATE_FFFD
+
+kernel_context_switch_48k:
+
+    ;; ------------------------------------------------------------------------
+    ;; copy the restore code, followed by the header fields from I to
+    ;; INT_MODE, to the last page of runtime data
+    ;; ------------------------------------------------------------------------
+
+    ld    hl, #RESIDENT_RESTORE_IMAGE
+    ld    de, #RESIDENT_RESTORE
+    ld    bc, #resident_restore_image_end - resident_restore_image
+    ldir
+
+    ld    hl, #stored_snapshot_header + Z80_HEADER_OFFSET_I - 1
+    ld    c, #Z80_HEADER_OFFSET_INT_MODE + 2 - Z80_HEADER_OFFSET_I
+    ldir                                 ;; B == 0 after LDIR above
+
+    ;; ------------------------------------------------------------------------
+    ;; read the evacuated data (bank 0 is selected here)
+    ;; ------------------------------------------------------------------------
+
+    ld    hl, #ENC28J60_EVACUATED_DATA
+    ld    a, #OPCODE_WCR + (ERDPTL & REG_MASK)
+    rst   enc28j60_write_register16
+
+    ld    c, #OPCODE_RBM
+    rst   spi_write_byte
+
+    ld    bc, #0x0100 * (SPI_IDLE + SPI_MOSI) + SPI_OUT
+    ld    d, #SPI_IDLE + SPI_SCK
+
+    jp    RESIDENT_RESTORE
+
+resident_kernel_image_end:
+
+;; ----------------------------------------------------------------------------
+;; addresses of the kernel code, once copied into place
+;; ----------------------------------------------------------------------------
+
+resident_verify_checksum = RESIDENT_KERNEL + kernel_verify_checksum - resident_kernel_image
+resident_payload_length = RESIDENT_KERNEL + kernel_payload_length - resident_kernel_image
+resident_dma_checksum = RESIDENT_KERNEL + kernel_dma_checksum - resident_kernel_image
+resident_read_payload = RESIDENT_KERNEL + kernel_read_payload - resident_kernel_image
+resident_payload_address = RESIDENT_KERNEL + kernel_payload_address - resident_kernel_image
+resident_wrap_rx_address = RESIDENT_KERNEL + kernel_wrap_rx_address - resident_kernel_image
+resident_measure_rtt = RESIDENT_KERNEL + kernel_measure_rtt - resident_kernel_image
+resident_retransmit = RESIDENT_KERNEL + kernel_retransmit - resident_kernel_image
+resident_send_ack = RESIDENT_KERNEL + kernel_send_ack - resident_kernel_image
+resident_clock_update = RESIDENT_KERNEL + kernel_clock_update - resident_kernel_image
+resident_read_memory = RESIDENT_KERNEL + kernel_read_memory - resident_kernel_image
+resident_read_memory_loop = RESIDENT_KERNEL + kernel_read_memory_loop - resident_kernel_image
+resident_read_memory_odd_byte = RESIDENT_KERNEL + kernel_read_memory_odd_byte - resident_kernel_image
+resident_ret = RESIDENT_KERNEL + kernel_ret - resident_kernel_image
+resident_send_telemetry = RESIDENT_KERNEL + kernel_send_telemetry - resident_kernel_image
+resident_context_switch = RESIDENT_KERNEL + kernel_context_switch - resident_kernel_image
+
+;; ----------------------------------------------------------------------------
+;; end of the kernel, once copied into place: at most _font_data + 96 * 8,
+;; the end of the font buffer (checked in the Makefile)
+;; ----------------------------------------------------------------------------
+
+resident_kernel_end == RESIDENT_KERNEL + resident_kernel_image_end - resident_kernel_image
+
+
+;; ############################################################################
+;; resident_restore
+;;
+;; Restore the evacuated data for 0x5800..0x62FF, then restore registers as in
+;; PERFORM_CONTEXT_SWITCH, and let context_switch_restore_bytes_loop (ROM)
+;; restore the remaining page, including this code. Each byte takes 410
+;; T-states here, compared to 617 in the ROM.
+;;
+;; Runs at RESIDENT_RESTORE, where resident_context_switch copies it, along
+;; with the stored header fields it pops. Until then, it is kept in the font
+;; buffer, in the place of the glyphs ' ' .. '/' (not used while loading).
+;;
+;; On entry, RBM has been sent, and
+;;
+;;   B  == SPI_IDLE+SPI_MOSI
+;;   C  == SPI_OUT
+;;   D  == SPI_IDLE+SPI_SCK
+;; ############################################################################
+
+RESIDENT_RESTORE_IMAGE = _font_data
+RESIDENT_RESTORE = RUNTIME_DATA + RUNTIME_DATA_LENGTH - 0x0100
+
+    .area _NONRESIDENT
+
+resident_restore_image:
+
+    ld    hl, #RUNTIME_DATA
+
+    ;; =======================================================================
+    ;; each resident_restore_loop iteration (8 bits) takes 410 T-states
+    ;;   <=> 68.29 kbit/s  (48k machines @3.5MHz)
+    ;;       69.21 kbit/s  (128k machines @3.54690MHz)
+    ;; =======================================================================
+
+kernel_restore_loop:
+
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E
+    READ_BIT_TO_E                        ;; 376  (47 * 8)
+
+    ld    (hl), e                        ;;   7
+    inc   hl                             ;;   6
+    ld    a, h                           ;;   4
+    cp    a, #>RESIDENT_RESTORE          ;;   7
+    jp    nz, resident_restore_loop      ;;  10
+
+    ;; ------------------------------------------------------------------------
+    ;; restore I, border, DE, alternate registers, IX, IY, and interrupt mode,
+    ;; as in PERFORM_CONTEXT_SWITCH
+    ;; ------------------------------------------------------------------------
+
+    ld    sp, #RESIDENT_RESTORE + resident_restore_image_end - resident_restore_image
+
+    pop   af
+    ld    i, a
+    pop   af
+    out   (ULA_PORT), a
+
+    pop   de
+    exx
+    pop   bc
+    pop   de
+    pop   hl
+    exx
+
+    pop   bc
+    dec   sp
+    pop   af
+    dec   sp
+    ld    a, c
+    ex    af, af'
+
+    pop   iy
+    pop   ix
+
+    inc   sp
+    pop   af
+
+    im    1
+    rra
+    jr    c, resident_restore_im_set
+    im    2
+    rra
+    jr    c, resident_restore_im_set
+    im    0
+
+resident_restore_im_set:
+
+    ;; ------------------------------------------------------------------------
+    ;; HL == RESIDENT_RESTORE: let the ROM restore the last page
+    ;; ------------------------------------------------------------------------
+
+    ld    sp, #spi_restore_stack_top
+    jp    context_switch_restore_bytes_loop
+
+resident_restore_image_end:
+
+resident_restore_loop = RESIDENT_RESTORE + kernel_restore_loop - resident_restore_image
+
+;; ----------------------------------------------------------------------------
+;; size of the restore code: at most 128 bytes, the glyphs ' ' .. '/' it
+;; replaces in the font buffer (checked in the Makefile)
+;; ----------------------------------------------------------------------------
+
+resident_restore_image_size == resident_restore_image_end - resident_restore_image
+
+
+;; ############################################################################
+;; resident_s_header
+;;
+;; Initial .z80 loader state: s_header, followed by increasing
+;; kilobytes_expected by one. The context switch in z80_loader is then never
+;; reached, and resident_payload makes it instead (resident_context_switch).
+;; Bit 7 (128k snapshot) is not affected.
+;;
+;; Only called for the first DATA block, before any snapshot data is stored,
+;; so this can be non-resident code.
+;;
+;; The time from the read request to this first DATA block is recorded for the
+;; boot telemetry. Any OACK arriving after this block is ignored, as it is
+;; after an accepted OACK.
+;; ############################################################################
+
+    .area _NONRESIDENT
+
+resident_s_header:
+
+    push  de
+    push  hl
+    ld    hl, #resident_ret              ;; ignore any late OACK
+    ld    (resident_oack_jump + 1), hl
+    ld    hl, (_timer_tick_count)
+    ld    de, (resident_clock)
+    add   hl, de
+    ld    (telemetry_request_ticks), hl
+    pop   hl
+    pop   de
+
+    ld    ix, #s_header                  ;; SWITCH_STATE only sets IXL
+    call  s_header
+
+    push  hl                             ;; chunk length, for a 48k snapshot
+    ld    hl, #kilobytes_expected
+    inc   (hl)
+    bit   7, (hl)
+    pop   hl
+    ret   z                              ;; 48k snapshot
+
+    ;; ------------------------------------------------------------------------
+    ;; Zero-length chunks directly after the header of a 128k snapshot mark
+    ;; pages to be filled with a single value (utils/z80-zero-pages.py). Each
+    ;; marker is four bytes: chunk length 0, page ID, and fill value. The
+    ;; high nibble of the page ID is the number of kilobytes (k) that a later
+    ;; chunk for the page holds: the page then ends with a run of the fill
+    ;; value, and the chunk only covers the first k kilobytes. Fill these
+    ;; pages, and count the remaining 16 - k kilobytes as loaded.
+    ;;
+    ;; The markers are consumed here, so they must all be in this first DATA
+    ;; block, followed by at least a complete chunk header. The next state is
+    ;; s_chunk_header, so HL and DE need not be preserved.
+    ;; ------------------------------------------------------------------------
+
+resident_zero_page_loop:
+
+    ld    a, b
+    or    a, a
+    jr    nz, resident_zero_page_marker   ;; BC >= 256
+    ld    a, c
+    cp    a, #3
+    jr    c, resident_zero_page_invalid   ;; chunk header not in this block
+
+resident_zero_page_marker:
+
+    ld    a, 0(iy)
+    or    a, 1(iy)
+    ret   nz                             ;; a chunk with data
+
+    ld    a, c                           ;; BC == 3: marker not in this block
+    sub   a, #3
+    or    a, b
+    jr    z, resident_zero_page_invalid
+
+    ;; ------------------------------------------------------------------------
+    ;; The page ID must be in 3..10, and not 8 (bank 5, holding this code)
+    ;; ------------------------------------------------------------------------
+
+    ld    a, 2(iy)
+    and   a, #0x0f
+    sub   a, #3
+    cp    a, #8
+    jr    nc, resident_zero_page_invalid
+    cp    a, #5
+    jr    z, resident_zero_page_invalid
+
+    push  bc
+
+    ld    bc, #MEMCFG_ADDR
+    out   (c), a
+
+    ld    hl, #0xc000
+    ld    de, #0xc001
+    ld    bc, #0x3fff
+    ld    a, 3(iy)
+    ld    (hl), a
+    ldir                                 ;; D == 0 for update_progress below
+
+    ld    a, 2(iy)                       ;; B := 16 - k
+    rrca
+    rrca
+    rrca
+    rrca
+    cpl
+    and   a, #0x0f
+    inc   a
+    ld    b, a
+resident_zero_page_progress:
+    call  update_progress
+    djnz  resident_zero_page_progress
+
+    pop   bc
+
+    ld    de, #4
+    add   iy, de
+    dec   bc
+    dec   bc
+    dec   bc
+    dec   bc
+
+    jr    resident_zero_page_loop
+
+resident_zero_page_invalid:
+
+    xor   a, a                           ;; FATAL_INTERNAL_ERROR
+    jp    fail
+
+
+;; ############################################################################
+;; resident_receive_oack
+;;
+;; Handle an OACK (RFC 2347): pick up the "blksize" and "windowsize" options
+;; (identified by their first letter), check "tsize", and acknowledge with
+;; block number 0.
+;; ############################################################################
+
+    .area _NONRESIDENT
+
+resident_receive_oack:
+
+    call  resident_verify_checksum       ;; in the receive buffer
+    ret   nz                             ;; dropped: the server resends it
+
+    call  resident_read_payload
+
+    ld    hl, #resident_ret              ;; ignore any repeated OACK
+    ld    (resident_oack_jump + 1), hl
+
+    ;; ------------------------------------------------------------------------
+    ;; push a pointer to the end of the UDP payload
+    ;; ------------------------------------------------------------------------
+
+    ld    hl, (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_LENGTH)
+    ld    a, h                           ;; swap byte order in HL
+    ld    h, l
+    ld    l, a
+    ld    de, #_rx_frame + IPV4_HEADER_SIZE
+    add   hl, de
+    push  hl
+
+    ld    de, #_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_SIZE + TFTP_SIZE_OF_OPCODE
+
+resident_oack_option_loop:
+
+    pop   hl
+    push  hl
+    or    a, a
+    sbc   hl, de
+    jr    z, resident_oack_done
+
+    ld    a, (de)                        ;; first letter of option name
+    or    a, #0x20                       ;; option names are case-insensitive
+    push  af
+
+resident_oack_skip_name:
+    ld    a, (de)
+    inc   de
+    or    a, a
+    jr    nz, resident_oack_skip_name
+
+    pop   af
+    push  af
+    cp    a, #'t'                        ;; "tsize"
+    call  z, resident_oack_check_tsize
+
+    call  parse_decimal
+
+    pop   af
+    cp    a, #'b'                        ;; "blksize"
+    jr    nz, resident_oack_not_blksize
+    ld    (_tftp_blksize), hl
+resident_oack_not_blksize:
+    cp    a, #'w'                        ;; "windowsize"
+    jr    nz, resident_oack_option_loop
+    ld    a, l
+    ld    (tftp_windowsize), a
+    jr    resident_oack_option_loop
+
+resident_oack_done:
+
+    pop   hl
+
+    ;; ------------------------------------------------------------------------
+    ;; UDP length of a full DATA packet, in network order
+    ;; ------------------------------------------------------------------------
+
+    ld    hl, (_tftp_blksize)
+    ld    bc, #UDP_HEADER_SIZE + TFTP_HEADER_SIZE
+    add   hl, bc
+    ld    a, l
+    ld    l, h
+    ld    h, a
+    ld    (tftp_full_udp_length), hl
+
+    ;; ------------------------------------------------------------------------
+    ;; acknowledge with block number 0
+    ;; ------------------------------------------------------------------------
+
+    ld    l, b                            ;; B == 0 here, HL := 0
+    ld    h, b
+    ld    (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_SIZE + TFTP_OFFSET_OF_BLOCKNO), hl
+
+    jp    resident_ack
+
+
+;; ############################################################################
+;; resident_oack_check_tsize
+;;
+;; Fail with FATAL_FILE_TOO_LARGE if the decimal "tsize" value at DE is
+;; SNAPSHOT_SIZE_LIMIT_256 * 256 or larger, before any DATA is transferred.
+;; The value is parsed into C:HL (24 bits), as parse_decimal only handles 16.
+;;
+;; The value is not kept for the progress bar: update_progress (z80_loader)
+;; counts decompressed kilobytes against kilobytes_expected (48 or 128, from
+;; the snapshot header), which is already exact, whereas "tsize" counts
+;; compressed bytes. Scaling by "tsize" would need a byte counter in the
+;; resident receive path, and a different update_progress in the full ROM.
+;;
+;; DE is preserved. AF, BC, and HL are destroyed.
+;; ############################################################################
+
+    .area _NONRESIDENT
+
+resident_oack_check_tsize:
+
+    push  de
+    ld    hl, #0
+    ld    c, l
+
+resident_oack_tsize_loop:
+
+    ld    a, h                           ;; C:H < SNAPSHOT_SIZE_LIMIT_256?
+    cp    a, #<SNAPSHOT_SIZE_LIMIT_256
+    ld    a, c
+    sbc   a, #>SNAPSHOT_SIZE_LIMIT_256
+    ld    a, #FATAL_FILE_TOO_LARGE
+    jp    nc, fail
+
+    ld    a, (de)
+    inc   de
+    or    a, a
+    jr    z, resident_oack_tsize_done
+
+    sub   a, #'0'
+    push  de
+    push  af
+
+    ld    d, h                           ;; C:HL := C:HL * 10
+    ld    e, l
+    ld    b, c
+    add   hl, hl
+    rl    c
+    add   hl, hl
+    rl    c
+    add   hl, de
+    ld    a, c
+    adc   a, b
+    ld    c, a
+    add   hl, hl
+    rl    c
+
+    pop   af                             ;; add digit value
+    ld    e, a
+    ld    d, #0
+    add   hl, de
+    jr    nc, resident_oack_tsize_no_carry
+    inc   c
+resident_oack_tsize_no_carry:
+
+    pop   de
+    jr    resident_oack_tsize_loop
+
+resident_oack_tsize_done:
+
+    pop   de
+    ret
+
+
+;; ############################################################################
+;; resident_request_snapshot
+;;
+;; Same as tftp_read_request (PREPARE_TFTP_READ_REQUEST in tftp.inc), except
+;; for the client port, the "windowsize" and "tsize" options, and the request
+;; being sent directly to the MAC address of the TFTP server.
+;; ############################################################################
+
+    .area _NONRESIDENT
+
+resident_request_snapshot:
+
+    ;; ------------------------------------------------------------------------
+    ;; install the resident kernel and restore code (the font is no longer
+    ;; needed, except for the digits)
+    ;; ------------------------------------------------------------------------
+
+    push de
+    ld   hl, #resident_kernel_image
+    ld   de, #RESIDENT_KERNEL
+    ld   bc, #resident_kernel_image_end - resident_kernel_image
+    ldir
+    ld   hl, #resident_restore_image
+    ld   de, #RESIDENT_RESTORE_IMAGE
+    ld   c, #resident_restore_image_end - resident_restore_image
+    ldir
+    pop  de
+
+    ld   hl, #resident_s_header              ;; state for .z80 snapshot loading
+    ld   (tftp_state), hl
+
+    ;; ------------------------------------------------------------------------
+    ;; set UDP ports
+    ;; ------------------------------------------------------------------------
+
+    ld   hl, #UDP_PORT_TFTP_SERVER * 0x0100    ;; network order
+    ld   (_header_template + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_DST_PORT), hl
+    ld   a, r
+    ld   (_tftp_client_port), a
+    ld   l, a
+    ld   h, #UDP_PORT_RESIDENT_CLIENT
+    ld   (_header_template + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_SRC_PORT), hl
+
+    ;; ------------------------------------------------------------------------
+    ;; expect block 1, and acknowledge every block, with the default block
+    ;; size, until an OACK says otherwise
+    ;; ------------------------------------------------------------------------
+
+    ld   a, #1
+    ld   (expected_tftp_block_no), a
+    ld   hl, #tftp_windowsize
+    ld   (hl), a
+    inc  hl
+    ld   (hl), a                             ;; tftp_window_end
+
+    ;; ------------------------------------------------------------------------
+    ;; initial round-trip time estimate
+    ;; ------------------------------------------------------------------------
+
+    ld   hl, #resident_srtt
+    ld   (hl), #RESIDENT_SRTT_INITIAL
+    inc  hl
+    ld   (hl), #RESIDENT_SRTT_INITIAL * 2 + RESIDENT_RTO_MIN
+
+    ;; ------------------------------------------------------------------------
+    ;; clear resident_rtt_ambiguous and the telemetry, including
+    ;; resident_clock: this request starts the clock
+    ;; ------------------------------------------------------------------------
+
+    ld   b, #telemetry_end - resident_rtt_ambiguous
+resident_clear_telemetry_loop:
+    inc  hl
+    ld   (hl), #0
+    djnz resident_clear_telemetry_loop
+
+    ld   hl, #TFTP_DEFAULT_BLKSIZE
+    ld   (_tftp_blksize), hl
+    ld   hl, #((TFTP_DEFAULT_UDP_LENGTH & 0xff) << 8) + (TFTP_DEFAULT_UDP_LENGTH >> 8)
+    ld   (tftp_full_udp_length), hl
+
+    ;; ------------------------------------------------------------------------
+    ;; calculate length of filename (see PREPARE_TFTP_READ_REQUEST)
+    ;;
+    ;; The IP length is computed as a byte (udp_create), so the filename can
+    ;; be at most 255 - IPV4_HEADER_SIZE - UDP_HEADER_SIZE
+    ;; - TFTP_SIZE_OF_RRQ_PREFIX - 40 (options) - 1 (NUL) = 184 characters.
+    ;; utils/speccyboot-update skips longer ones.
+    ;; ------------------------------------------------------------------------
+
+    ex   de, hl
+    push hl
+
+    xor  a, a
+    ld   c, a
+    cpir
+    ld   b, a
+    ld   e, a
+
+    sub  a, c
+    ld   c, a
+
+    push bc
+
+    add  a, #UDP_HEADER_SIZE + TFTP_SIZE_OF_RRQ_PREFIX + resident_rrq_option_end - resident_rrq_option_start
+    ld   d, a
+
+    ;; ------------------------------------------------------------------------
+    ;; The last frame received was the final DATA packet of the stage 2
+    ;; binary, so eth_sender_address holds the MAC address of the TFTP server
+    ;; (or a router on the way). Unless that packet came from another IP
+    ;; address, send the request there, rather than broadcast it. This also
+    ;; goes for any re-transmissions of it.
+    ;; ------------------------------------------------------------------------
+
+    push de
+    ld   de, #_rx_frame + IPV4_HEADER_OFFSETOF_SRC_ADDR
+    ld   hl, #_ip_config + IP_CONFIG_TFTP_ADDRESS_OFFSET
+    call memory_compare_4_bytes
+    pop  de
+
+    ld   hl, #eth_sender_address
+    jr   z, resident_request_to_server
+    ld   hl, #eth_broadcast_address
+resident_request_to_server:
+
+    ld   bc, #_ip_config + IP_CONFIG_TFTP_ADDRESS_OFFSET
+    call udp_create
+
+    rst  enc28j60_write_memory_inline
+
+    .db  resident_rrq_prefix_end - resident_rrq_prefix_start
+
+resident_rrq_prefix_start:
+    .db  0, TFTP_OPCODE_RRQ    ;; opcode in network order
+resident_rrq_prefix_end:
+
+    pop  de
+    pop  hl
+
+    rst  enc28j60_write_memory_small
+
+    rst  enc28j60_write_memory_inline
+
+    .db  resident_rrq_option_end - resident_rrq_option_start
+
+resident_rrq_option_start:
+    .ascii "octet"
+    .db    0
+    .ascii "blksize"
+    .db    0
+    .ascii "1024"              ;; TFTP_DATA_MAXSIZE
+    .db    0
+    .ascii "windowsize"
+    .db    0
+    .db    '0' + TFTP_WINDOWSIZE
+    .db    0
+    .ascii "tsize"
+    .db    0
+    .ascii "0"
+    .db    0
+resident_rrq_option_end:
+
+    jp   ip_send
@@ -59,8 +59,6 @@ SERVER_IP_POS = (BITMAP_BASE + 0x1100 + 7*32 + 16)
 
 ;; ============================================================================
 
-ETH_ADM_HEADER_SIZE = 20
-
     .area _DATA
 
 ;; ============================================================================
@@ -121,6 +119,17 @@ _tftp_write_pos:
 _chunk_bytes_remaining:
    .ds   2
 
+;; ----------------------------------------------------------------------------
+;; Negotiated TFTP block size (set in tftp_read_request, updated by an OACK),
+;; directly followed by the expected block number (so tftp_read_request can
+;; set the high byte of the former, and the latter, in a single 16-bit write)
+;; ----------------------------------------------------------------------------
+
+_tftp_blksize:
+   .ds   2
+expected_tftp_block_no:
+   .ds   1
+
 ;; ----------------------------------------------------------------------------
 ;; function called for every received TFTP packet
 ;; ----------------------------------------------------------------------------
@@ -177,12 +186,10 @@ _tftp_client_port:
 main_loop:
 
     ;; ------------------------------------------------------------------------
-    ;; The menu (stage 2) JP:s here to load snapshots.lst.
-    ;; Save a few bytes of stack.
+    ;; The menu (stage 2) JP:s here to load a page of the snapshot list,
+    ;; after resetting SP.
     ;; ------------------------------------------------------------------------
 
-    ld    sp, #_stack_top
-
     ;; ------------------------------------------------------------------------
     ;; Spin here until at least one frame is received. Do this by
     ;; polling EPKTCNT. (Errata rev B5, item #4: do not trust EIR.PKTIF)
@@ -213,7 +220,6 @@ main_loop:
 
     ld    hl, (_end_of_critical_frame)
     ld    de, #ENC28J60_TXBUF1_START
-    ;; B == 0 from enc28j60_read_register
     call  nz, perform_transmission
 
     jr    main_loop
@@ -276,11 +282,11 @@ main_packet_done:
 
     ;; ------------------------------------------------------------------------
     ;; advance ERXRDPT
+    ;;
+    ;; Bank 0 (ERXRDPT) is still selected here: ip_receive and arp_receive
+    ;; only ever leave bank 0 selected (see eth_create, perform_transmission).
     ;; ------------------------------------------------------------------------
 
-    ld    e, #0     ;; bank of ERXRDPT
-    rst   enc28j60_select_bank
-
     ;; errata B5, item 11:  EXRDPT must always be written with an odd value
 
     ld    hl, (_next_frame)
@@ -295,6 +301,9 @@ main_packet_done:
 
 ;; ############################################################################
 ;; eth_init
+;;
+;; Does not touch _next_frame: it is zero after initialize_global_data (init.asm),
+;; and the menu (stage 2) resets it itself after calling eth_init again.
 ;; ############################################################################
 
 eth_init:
@@ -332,15 +341,6 @@ eth_init:
     ld    hl, #ESTAT_CLKRDY + 0x0100 * ESTAT_CLKRDY
     call  poll_register
 
-    ;; ------------------------------------------------------------------------
-    ;; HL is 0x0101 (from poll_register above),
-    ;; and needs to be 0x0000 (ENC28J60_RXBUF_START)
-    ;; ------------------------------------------------------------------------
-
-    dec   h
-    dec   l
-    ld    (_next_frame), hl
-
     ;; ========================================================================
     ;; set up initial register values for ENC28J60
     ;; ========================================================================
@@ -412,7 +412,11 @@ eth_register_defaults:
     .db   ERXRDPTL, <ENC28J60_RXBUF_END
     .db   ERXRDPTH, >ENC28J60_RXBUF_END
 
-    .db   ERXFCON,  ERXFCON_CRCEN
+    ;; Accept frames for our MAC address, and broadcasts (ARP, BOOTP), with
+    ;; a valid CRC. Multicast frames are dropped by the ENC28J60. Broadcasts
+    ;; are further restricted to ARP requests for us by menu.asm, before a
+    ;; snapshot is requested.
+    .db   ERXFCON,  ERXFCON_UCEN + ERXFCON_BCEN + ERXFCON_CRCEN
 
     ;; MAC initialization: half duplex
     .db   MACON1,   MACON1_MARXEN
@@ -447,10 +451,8 @@ eth_register_defaults:
     .db   MIREGADR, PHSTAT2
     .db   MICMD,    MICMD_MIISCAN
 
-    ;; Enable reception and transmission
-    .db   EIE,      0x00     ;; disable all interrupts
-    .db   EIR,      0x00     ;; no pending interrupts
-    .db   ECON2,    ECON2_AUTOINC
+    ;; Enable reception and transmission. EIE (all interrupts disabled),
+    ;; EIR (none pending), and ECON2 (AUTOINC set) keep their reset values.
     .db   ECON1,    ECON1_RXEN
 
     .db   END_OF_TABLE
@@ -469,19 +471,12 @@ eth_create:
 
     push  de
     push  bc
-    push  hl
-
-    ;; ------------------------------------------------------------------------
-    ;; select default bank for ENC28J60
-    ;; ------------------------------------------------------------------------
-
-    ld    e, #0
-    rst   enc28j60_select_bank
-
-    pop   hl
 
     ;; ------------------------------------------------------------------------
     ;; set up EWRPT for writing packet data
+    ;;
+    ;; Bank 0 is always selected here: eth_init leaves it selected (ECON1 is
+    ;; written last), and so does main_packet before any reply is created.
     ;; ------------------------------------------------------------------------
 
     ld    a, #OPCODE_WCR + (EWRPTL & REG_MASK)
@@ -534,12 +529,15 @@ eth_create:
 
 tftp_reply:
 
+    ;; ------------------------------------------------------------------------
+    ;; The source port was already set by tftp_read_request (and is the
+    ;; destination port of the received packet), so only the destination
+    ;; port needs to be updated.
+    ;; ------------------------------------------------------------------------
+
     ld   hl, (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_SRC_PORT)
     ld   (_header_template + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_DST_PORT), hl
 
-    ld   hl, (_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_DST_PORT)
-    ld   (_header_template + IPV4_HEADER_SIZE + UDP_HEADER_OFFSETOF_SRC_PORT), hl
-
     ld   hl, #eth_sender_address
 
     ld   bc, #_rx_frame + IPV4_HEADER_OFFSETOF_SRC_ADDR
@@ -584,9 +582,9 @@ udp_create:
     ;; TFTP read request: UDP_HEADER_SIZE
     ;;                       + TFTP_SIZE_OF_RRQ_PREFIX
     ;;                       + TFTP_SIZE_OF_RRQ_OPTION
-    ;;                    = 27 = 0x1b
+    ;;                    = 29 = 0x1d
+    ;;                    (plus file name, at most 206 bytes)
     ;; TFTP ACK: UDP_HEADER_SIZE + TFTP_SIZE_OF_ACK_PACKET = 8 + 4 = 0x0c
-    ;; TFTP ERROR: UDP_HEADER_SIZE + TFTP_SIZE_OF_ERROR_PACKET = 8 + 5 = 0x0d
     ;;
     ;; In all these cases, the lower byte (that is, H in network order)
     ;; is < 0xfc, so adding IPV4_HEADER_SIZE = 20 = 0x14 as a byte addition
@@ -604,10 +602,10 @@ udp_create:
     ld    (_header_template + 2), hl
 
     ;; copy source IP address
+    ;; (DE points to _header_template + 12 after LDIR above, and BC == 0)
 
-    ld    de, #_header_template + 12   ;; source IP address
     ld    hl, #_ip_config + IP_CONFIG_HOST_ADDRESS_OFFSET
-    ld    bc, #4
+    ld    c, #4
     ldir
 
     ;; copy destination IP address
@@ -982,16 +980,11 @@ arp_header_template_end:
     ld   hl, #_ip_config + IP_CONFIG_HOST_ADDRESS_OFFSET
     rst  enc28j60_write_memory_small
 
-    ;; THA
+    ;; THA and TPA: sender MAC and IP addresses, taken from the SHA and SPA
+    ;; fields in the request (adjacent, so both are written at once)
 
-    ld   e, #ETH_ADDRESS_SIZE
-    ld   l, #<_rx_frame + ARP_OFFSET_SHA  ;; sender MAC address, taken from SHA field in request
-    rst  enc28j60_write_memory_small
-
-    ;; TPA
-
-    ld   l, #<_rx_frame + ARP_OFFSET_SPA  ;; sender IP address, taken from SPA field in request
-    ld   e, #IPV4_ADDRESS_SIZE
+    ld   e, #ETH_ADDRESS_SIZE + IPV4_ADDRESS_SIZE
+    ld   l, #<_rx_frame + ARP_OFFSET_SHA
     rst  enc28j60_write_memory_small
 
     ld   hl, #ARP_IP_ETH_PACKET_SIZE
@@ -1050,7 +1043,6 @@ eth_send:
 ;; Does not return until the frame has been transmitted.
 ;;
 ;; A: border colour, to indicate regular transmission/retransmission
-;; B: must be 0
 ;; DE: address of the first byte in the frame
 ;; HL: address of the last byte in the frame
 ;; ############################################################################
@@ -1063,14 +1055,30 @@ perform_transmission:
 
     out   (ULA_PORT), a
 
+    push  hl   ;; remember HL=end_address
+    push  de
+
     ;; ----------------------------------------------------------------------
-    ;; set up registers:  ETXST := start_address, ETXND := end_address
+    ;; Poll for link to come up (if it has not already)
+    ;;
+    ;; NOTE: this code assumes the MIREGADR/MICMD registers to be configured
+    ;;       for continuous scanning of PHSTAT2 -- see eth_init
     ;; ----------------------------------------------------------------------
 
-    push  hl   ;; remember HL=end_address
-    push  de
+    ld    e, #2             ;; bank 2 for MIRDH
+    rst   enc28j60_select_bank
 
-    ld    e, b     ;; B == 0: bank of ETXST and ETXND
+    ;; poll MIRDH until PHSTAT2_HI_LSTAT is set
+
+    ld    de, #(MIRDH & REG_MASK) + (16 << 8)  ;; MIRDH is a MAC_MII register
+    ld    hl, #PHSTAT2_HI_LSTAT * 0x100 + PHSTAT2_HI_LSTAT
+    call  poll_register
+
+    ;; ----------------------------------------------------------------------
+    ;; set up registers:  ETXST := start_address, ETXND := end_address
+    ;; ----------------------------------------------------------------------
+
+    ld    e, #0     ;; bank of ETXST, ETXND, and ECON1
     rst   enc28j60_select_bank
 
     pop   hl
@@ -1098,22 +1106,6 @@ perform_transmission:
     ld    c, b
     ld    (_timer_tick_count), bc
 
-    ;; ----------------------------------------------------------------------
-    ;; Poll for link to come up (if it has not already)
-    ;;
-    ;; NOTE: this code assumes the MIREGADR/MICMD registers to be configured
-    ;;       for continuous scanning of PHSTAT2 -- see eth_init
-    ;; ----------------------------------------------------------------------
-
-    ld    e, #2             ;; bank 2 for MIRDH
-    rst   enc28j60_select_bank
-
-    ;; poll MIRDH until PHSTAT2_HI_LSTAT is set
-
-    ld    de, #(MIRDH & REG_MASK) + (16 << 8)  ;; MIRDH is a MAC_MII register
-    ld    hl, #PHSTAT2_HI_LSTAT * 0x100 + PHSTAT2_HI_LSTAT
-    call  poll_register
-
     ;; ----------------------------------------------------------------------
     ;; Errata, item 10:
     ;;
@@ -1121,9 +1113,6 @@ perform_transmission:
     ;; set bit TXRST in ECON1, then clear it
     ;; ----------------------------------------------------------------------
 
-    ld    e, #0    ;; bank of ECON1
-    rst   enc28j60_select_bank
-
     ld    hl, #0x0100 * ECON1_TXRST + OPCODE_BFS + (ECON1 & REG_MASK)
     rst   enc28j60_write8plus8
 
@@ -1131,21 +1120,12 @@ perform_transmission:
     ld    l, #OPCODE_BFC + (ECON1 & REG_MASK)
     rst   enc28j60_write8plus8
 
-    ;; ----------------------------------------------------------------------
-    ;; clear EIE.TXIE, EIR.TXIF, EIR.TXERIF, ESTAT.TXABRT
-    ;; ----------------------------------------------------------------------
-
-    ld    hl, #0x0100 * EIE_TXIE + OPCODE_BFC + (EIE & REG_MASK)
-    rst   enc28j60_write8plus8
-
-    ld    hl, #0x0100 * (EIR_TXIF + EIR_TXERIF) + OPCODE_BFC + (EIR & REG_MASK)
-    rst   enc28j60_write8plus8
-
-    ld    hl, #0x0100 * (ESTAT_TXABRT) + OPCODE_BFC + (ESTAT & REG_MASK)
-    rst   enc28j60_write8plus8
-
     ;; ----------------------------------------------------------------------
     ;; set ECON1.TXRTS, and poll it until it clears
+    ;;
+    ;; EIR.TXIF, EIR.TXERIF, and ESTAT.TXABRT are left as they are: they are
+    ;; never read (completion is detected by polling ECON1.TXRTS), and
+    ;; EIE.TXIE is never set, as EIE keeps its reset value.
     ;; ----------------------------------------------------------------------
 
     ld    hl, #0x0100 * ECON1_TXRTS + OPCODE_BFS + (ECON1 & REG_MASK)
@@ -1207,22 +1187,38 @@ tftp_default_file:
 
 tftp_state_menu_loader:
 
+    ;; ------------------------------------------------------------------------
+    ;; BC equals _tftp_blksize for all DATA packets except the last one,
+    ;; and is never larger. C flag is clear here (OR in tftp_state_loop).
+    ;; ------------------------------------------------------------------------
+
+    ld  hl, (_tftp_blksize)
+    sbc hl, bc ;; Z set for a full packet (LDIR below preserves it)
+
+    ;; ------------------------------------------------------------------------
+    ;; Fail if the data would run past the top of RAM. The ROM sends no
+    ;; "tsize" option for menu.bin, so this is checked for every packet.
+    ;; ------------------------------------------------------------------------
+
+    ld  h, d
+    ld  l, e
+    add hl, bc ;; preserves Z
+    ld  a, #FATAL_FILE_TOO_LARGE
+    jr  c, fail
+
     ld  hl, #_rx_frame + IPV4_HEADER_SIZE + UDP_HEADER_SIZE + TFTP_HEADER_SIZE
-    bit 1, b   ;; see below
     ldir
-    ld  (_tftp_write_pos), de
 
     ;; ------------------------------------------------------------------------
-    ;; If a full TFTP packet was loaded, return.
-    ;; (BC above should be exactly 0x200 for all DATA packets except the last
-    ;; one, never larger; so we are done if bit 1 is set in B)
+    ;; If a full TFTP packet was loaded, return (tftp_state_loop stores DE).
     ;; ------------------------------------------------------------------------
 
-    ret nz
+    ret z
 
     ;; ========================================================================
     ;; This was the last packet of the stage 2 binary:
-    ;; check version signature and run the stage 2 loader
+    ;; check version signature and run the stage 2 loader,
+    ;; with DE pointing to the end of the loaded data
     ;; ========================================================================
 
     ;; ------------------------------------------------------------------------
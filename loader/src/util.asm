@@ -63,6 +63,37 @@ a_div_b_loop:
     sub   a, b
     jr    a_div_b_loop
 
+;; ############################################################################
+;; parse_decimal
+;; ############################################################################
+
+parse_decimal:
+
+    ld    hl, #0
+
+parse_decimal_loop:
+
+    ld    a, (de)
+    inc   de
+
+    bit   4, a          ;; sets Z flag for NUL and '.'
+    ret   z
+
+    sub   a, #'0'
+
+    ld    b, h
+    ld    c, l
+    add   hl, hl
+    add   hl, hl
+    add   hl, bc
+    add   hl, hl        ;; HL := HL * 10
+
+    ld    c, a          ;; C now holds digit value 0..9
+    ld    b, #0
+    add   hl, bc
+
+    jr    parse_decimal_loop
+
 ;; ############################################################################
   
     .area _CODE
@@ -68,6 +68,13 @@ _digits:
 is_context_switch_set_up:
     .ds   1
 
+;; ----------------------------------------------------------------------------
+;; value to repeat in the current repetition sequence (ED ED nn xx)
+;; ----------------------------------------------------------------------------
+
+repetition_value:
+    .ds   1
+
 ;; ============================================================================
 
 ;; ----------------------------------------------------------------------------
@@ -273,24 +280,18 @@ s_header_set_state:
     ;; adjust IY and BC for header size
     ;; ------------------------------------------------------------------------
 
-    add  iy, bc
+    add  iy, bc     ;; no carry, as IY points into _rx_frame
 
     ;; ------------------------------------------------------------------------
-    ;; Safely assume that the TFTP packet is 0x200 bytes in length, as the RFC
-    ;; guarantees this for all packets but the last one.
-    ;;
-    ;; Set up BC as (0x0200 - C), that is,
-    ;;
-    ;;   C := 0 - C   and
-    ;;   B := 1.
-    ;;
-    ;; B is currently 0 (after initial LDIR above).
+    ;; BC := (TFTP payload length, stacked on entry) - (header size).
+    ;; Keep HL (chunk length) on the stack meanwhile.
     ;; ------------------------------------------------------------------------
 
-    xor  a, a
-    sub  a, c       ;; no carry expected, as C is at most 54 (0x36)
-    ld   c, a
-    inc  b          ;; B is now 1
+    ex   (sp), hl
+    sbc  hl, bc
+    ld   b, h
+    ld   c, l
+    pop  hl
 
     ;; ------------------------------------------------------------------------
     ;; Set up DE for a single 48k chunk, to be loaded at 0x4000. For a version
@@ -307,6 +308,8 @@ s_header_set_state:
 
 s_header:
 
+    push bc         ;; TFTP payload length, popped in s_header_set_state
+
     ;; ------------------------------------------------------------------------
     ;; clear out attribute line 23 for progress bar
     ;; ------------------------------------------------------------------------
@@ -601,10 +604,14 @@ s_chunk_repvalue:
     call load_byte_from_chunk
 
     ;; -------------------------------------------------------------------------
-    ;; the loaded byte does not need to be stored here:
-    ;; it is available as -1(iy) when needed
+    ;; The loaded byte is not necessarily available as -1(iy) for the whole
+    ;; repetition: when a kilobyte boundary is reached (update_progress), the
+    ;; repetition can continue in the next packet, where -1(iy) is part of the
+    ;; TFTP header. Keep a copy instead.
     ;; -------------------------------------------------------------------------
 
+    ld   (repetition_value), a
+
     SWITCH_STATE  s_chunk_repvalue  s_repetition
     ;; ld   ix, #s_repetition
 
@@ -631,12 +638,7 @@ s_repetition:
     dec  a
     ld   i, a
 
-    ;; -------------------------------------------------------------------------
-    ;; the byte to repeat is always the most recently loaded one, as this state
-    ;; (s_repetition) does not involve any loading of data (only writing)
-    ;; -------------------------------------------------------------------------
-
-    ld   a, -1(iy)
+    ld   a, (repetition_value)
 
     jr   store_byte
 
@@ -0,0 +1,194 @@
+#!/usr/bin/env python3
+
+# z80-zero-pages.py
+#
+# Rewrites a 128k .Z80 snapshot so that memory pages are not transferred
+# over the network where they hold a single fill value. Such pages are
+# marked by four-byte zero-length "marker" chunks (00 00 PP VV: page PP,
+# fill value VV), placed directly after the snapshot header. The SpeccyBoot
+# stage 2 loader fills these pages itself.
+#
+# A page that only ends with a run of one value (at least a kilobyte) is
+# marked too, with the number of kilobytes that still hold data (k, 1..15)
+# in the high nibble of PP. Its chunk then only covers these k kilobytes.
+# Runs elsewhere in a page are left to the usual ED ED compression, since
+# a chunk is always loaded from the start of its page.
+#
+# NOTE: converted snapshots can only be loaded from the SpeccyBoot menu.
+# Loaded directly from the boot ROM (for example, with a spectrum.cfg naming
+# the snapshot), the markers are taken as chunks, and the snapshot is not
+# loaded correctly. The --menu-only option is therefore required.
+#
+# Page 8 (bank 5, 0x4000..0x7fff) holds the loader itself during loading,
+# and is never marked. 48k snapshots are passed through unchanged.
+#
+# Part of the SpeccyBoot project <https://github.com/patrikpersson/speccyboot>
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright (c) 2009-  Patrik Persson
+#
+# Permission is hereby granted, free of charge, to any person
+# obtaining a copy of this software and associated documentation
+# files (the "Software"), to deal in the Software without
+# restriction, including without limitation the rights to use,
+# copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the
+# Software is furnished to do so, subject to the following
+# conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+# OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+# HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+# WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+# OTHER DEALINGS IN THE SOFTWARE.
+
+import sys
+import os.path
+import struct
+
+PAGE_SIZE        = 0x4000
+KILOBYTE         = 0x0400
+UNCOMPRESSED     = 0xffff     # chunk length for an uncompressed page (v3)
+LOADER_PAGE      = 8          # bank 5, never marked
+ESCAPE           = 0xED
+
+# -----------------------------------------------------------------------------
+
+def usage():
+  print("usage:")
+  print("  %s --menu-only <in.z80> <out.z80>" % os.path.basename(sys.argv[0]))
+  print("")
+  print("  The converted snapshot can only be loaded from the SpeccyBoot menu,")
+  print("  not directly from the boot ROM.")
+  exit(1)
+
+# -----------------------------------------------------------------------------
+
+def fail(msg):
+  sys.stderr.write("%s: %s\n" % (os.path.basename(sys.argv[0]), msg))
+  exit(1)
+
+# -----------------------------------------------------------------------------
+
+def decompress(data):
+  out = bytearray()
+  i = 0
+  while i < len(data):
+    if data[i] == ESCAPE and i + 1 < len(data) and data[i + 1] == ESCAPE:
+      out += bytes([data[i + 3]]) * data[i + 2]
+      i += 4
+    else:
+      out.append(data[i])
+      i += 1
+  return out
+
+# -----------------------------------------------------------------------------
+
+def compress(data):
+  out = bytearray()
+  i = 0
+  while i < len(data):
+    b = data[i]
+    n = 1
+    while i + n < len(data) and n < 255 and data[i + n] == b:
+      n += 1
+
+    # A single ED is never followed by a block. A single ED at the very end
+    # is stored as a block, since the loader would take it as an escape.
+
+    if n >= 5 or (b == ESCAPE and (n >= 2 or i + 1 == len(data))):
+      out += bytes([ESCAPE, ESCAPE, n, b])
+      i += n
+    elif b == ESCAPE:
+      out += bytes([b, data[i + 1]])
+      i += 2
+    else:
+      out.append(b)
+      i += 1
+  return out
+
+# -----------------------------------------------------------------------------
+
+def chunk(page, data):
+  data = compress(data)
+  return struct.pack("<HB", len(data), page) + data
+
+# -----------------------------------------------------------------------------
+
+def convert(snapshot):
+  if len(snapshot) < 32 or struct.unpack_from("<H", snapshot, 6)[0] != 0:
+    fail("not a version 2 or 3 snapshot")
+
+  header_length = 32 + struct.unpack_from("<H", snapshot, 30)[0]
+  header        = snapshot[:header_length]
+
+  # same rule as the loader: hardware type 3 or above means 128k
+
+  if snapshot[34] < 3:
+    return snapshot, []
+
+  # Rebuild the page contents. A page marked by an earlier conversion is
+  # filled first, and then overwritten by its (shorter) chunk, if any.
+
+  pages    = {}
+  original = {}
+  i        = header_length
+  while i < len(snapshot):
+    length, page = struct.unpack_from("<HB", snapshot, i)
+    if length == 0:
+      pages[page & 0x0f] = bytearray([snapshot[i + 3]]) * PAGE_SIZE
+      i += 4
+      continue
+    if length == UNCOMPRESSED:
+      data = snapshot[i + 3 : i + 3 + PAGE_SIZE]
+      end  = i + 3 + PAGE_SIZE
+    else:
+      data = decompress(snapshot[i + 3 : i + 3 + length])
+      end  = i + 3 + length
+    if len(data) == PAGE_SIZE:
+      original[page] = snapshot[i : end]
+    pages.setdefault(page, bytearray(PAGE_SIZE))[:len(data)] = data
+    i = end
+
+  markers = b""
+  chunks  = b""
+  filled  = []
+  for page in sorted(pages):
+    data  = pages[page]
+    value = data[-1]
+    run   = len(data) - len(data.rstrip(bytes([value])))
+    k     = (PAGE_SIZE - run + KILOBYTE - 1) // KILOBYTE
+
+    if page == LOADER_PAGE or k == PAGE_SIZE // KILOBYTE:
+      chunks += original.get(page) or chunk(page, data)
+      continue
+
+    markers += struct.pack("<HBB", 0, page + (k << 4), value)
+    filled.append((page, value, k))
+    if k:
+      chunks += chunk(page, data[:k * KILOBYTE])
+
+  return header + markers + chunks, filled
+
+# -----------------------------------------------------------------------------
+
+if len(sys.argv) != 4 or sys.argv[1] != "--menu-only": usage()
+
+with open(sys.argv[2], "rb") as f:
+  snapshot = f.read()
+
+result, filled = convert(snapshot)
+
+with open(sys.argv[3], "wb") as f:
+  f.write(result)
+
+print("%d bytes -> %d bytes, filled pages: %s"
+      % (len(snapshot), len(result),
+         " ".join("%d (0x%02x from %dK)" % p for p in filled) or "none"))